@@ -22,6 +22,7 @@
 
 #include <ctype.h>
     // Import isalnum()
+    // Import isdigit()
     // Import islower()
     // Import isprint()
     // Import isupper()
@@ -43,11 +44,30 @@
 #include <stdlib.h>
     // Import abort()
     // Import exit()
+    // Import strtoul()
 #include <string.h>
     // Import strcmp()
 #include <strings.h>
     // Import strncasecmp()
+#include <pthread.h>
+    // Import pthread_cond_broadcast()
+    // Import pthread_cond_wait()
+    // Import pthread_create()
+    // Import pthread_join()
+    // Import pthread_mutex_lock()
+    // Import pthread_mutex_unlock()
+#include <fcntl.h>
+    // Import open()
+    // Import constant O_RDONLY
+#include <sys/mman.h>
+    // Import madvise()
+    // Import mmap()
+    // Import munmap()
+#include <sys/stat.h>
+    // Import fstat()
+    // Import S_ISREG()
 #include <unistd.h>
+    // Import close()
     // Import getopt_long()
     // Import type size_t
 
@@ -76,7 +96,15 @@ bool debug        = false;
 bool verbose      = false;
 
 static unsigned int devolve_options = 0;
+static unsigned int nthreads = 1;
+static unsigned int chunk_threads = 1;
+static bool check_only = false;
+static const char *check_arg = NULL;
+static enum devolve_check check_what = CHECK_UTF8;
 static enum cset charset = CHARSET_UTF8;
+static const char *table_fname = NULL;
+static devolve_table_t *table = NULL;
+static const char *engine_arg = NULL;
 
 FILE *errprint_fh = NULL;
 FILE *dbgprint_fh = NULL;
@@ -94,6 +122,10 @@ static struct option long_options[] = {
     {"trace-errors",   no_argument,       0,  'e'},
     {"trace-untrans",  no_argument,       0,  'u'},
     {"trace-conv",     no_argument,       0,  't'},
+    {"threads",        required_argument, 0,  'j'},
+    {"check",          optional_argument, 0,  'k'},
+    {"table",          required_argument, 0,  'T'},
+    {"engine",         required_argument, 0,  'g'},
     {0, 0, 0, 0}
 };
 
@@ -115,6 +147,20 @@ static const char usage_text[] =
     "  --trace-conv    Trace conversions on stderr as they happen\n"
     "  --trace-errors  Trace invalid UTF-8 byte sequences on stderr\n"
     "  --trace-untrans Trace valid but untranslated runes on stderr\n"
+    "  --check[=<charset>]\n"
+    "                  Do not devolve; only check that the input is valid,\n"
+    "                  and stop at the first invalid byte.  Exit status only.\n"
+    "                  <charset> is UTF-8, latin1, or ascii (pure 7-bit).\n"
+    "                  Default is the --charset\n"
+    "  --threads=N     Use N threads.  With several files, devolve N files\n"
+    "                  at once; with one large UTF-8 file, devolve it\n"
+    "                  in chunks.  Output is still in order.  Default is 1\n"
+    "  --table=FILE    Devolve UTF-8 using the compiled translation table\n"
+    "                  in FILE, made by build-table --binary,\n"
+    "                  instead of the built-in table\n"
+    "  --engine=NAME   Use the versions of the inner loops for the\n"
+    "                  instruction set, NAME: scalar, sse2, avx2, avx512,\n"
+    "                  or auto, the best this CPU can run.  Default is auto\n"
     "\n"
     "Only UTF-8 and latin1 are directly supported, for now.\n"
     "Other character sets could be handled by using recode\n"
@@ -255,46 +301,418 @@ vischar_r(char *buf, size_t sz, int c)
     return (buf);
 }
 
+/*
+ * Parse the argument to --threads.
+ * It must be a whole number, from 1 up to some sane limit.
+ */
 static int
-devolve_stream(fvh_t *fvp, FILE *dstf)
+parse_thread_count(const char *str, unsigned int *countp)
 {
-    switch (charset) {
-    default:
-        abort();
-        return (64);
-    case CHARSET_UTF8:
-        return (devolve_stream_utf8(fvp, dstf, devolve_options));
-    case CHARSET_LATIN1:
-        return (devolve_stream_latin1(fvp, dstf, devolve_options));
+    char *end;
+    unsigned long n;
+
+    if (!isdigit((unsigned char)*str)) {
+        return (-1);
+    }
+    n = strtoul(str, &end, 10);
+    if (*end != '\0' || n < 1 || n > 1024) {
+        return (-1);
     }
+    *countp = (unsigned int)n;
+    return (0);
 }
 
+/*
+ * Parse the argument to --engine.
+ * Return the engine, or -1 if there is no engine by that name.
+ */
 static int
-devolve_filev(size_t filec, char **filev, FILE *dstf)
+parse_engine(const char *str)
+{
+    int e;
+
+    for (e = DEVOLVE_ENGINE_AUTO; e <= DEVOLVE_ENGINE_MAX; ++e) {
+        if (strcmp(str, devolve_engine_name((enum devolve_engine)e)) == 0) {
+            return (e);
+        }
+    }
+    return (-1);
+}
+
+/*
+ * Each file gets a fresh context of its own.
+ * Counts and trace messages go to |errf|, or to stderr, if NULL.
+ */
+static void
+file_ctx_init(devolve_ctx_t *ctx, const char *fname, FILE *errf)
+{
+    devolve_ctx_init(ctx, charset, devolve_options);
+    ctx->fname = fname;
+    ctx->errf = errf;
+    ctx->table = table;
+}
+
+static int
+process_stream(devolve_ctx_t *ctx, FILE *srcf, FILE *dstf)
+{
+    if (check_only) {
+        return (devolve_check_stream(ctx, srcf, check_what));
+    }
+    return (devolve_stream(ctx, srcf, dstf));
+}
+
+static int
+process_mem(devolve_ctx_t *ctx, const void *buf, size_t len, FILE *dstf)
+{
+    if (check_only) {
+        return (devolve_check_mem(ctx, buf, len, check_what));
+    }
+    return (devolve_mem_mt(ctx, buf, len, dstf, chunk_threads));
+}
+
+/*
+ * Devolve a regular file straight from a read-only mapping of it,
+ * instead of copying it through stdio buffers.
+ *
+ * A file that turns out to be pure 7-bit ASCII needs no devolving.
+ * It is copied to the output in the kernel, if at all possible.
+ *
+ * Return -1, without having devolved anything, if the file is not
+ * a regular file, claims to be empty, or could not be mapped.
+ * The caller then falls back on reading it as a stream.
+ */
+static int
+devolve_mapped(devolve_ctx_t *ctx, int fd, FILE *dstf)
+{
+    struct stat statbuf;
+    void *map;
+    size_t len;
+    int rv;
+
+    if (fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) {
+        return (-1);
+    }
+    len = (size_t)statbuf.st_size;
+    if (len == 0) {
+        // Files in /proc and /sys have size 0, but not no content
+        return (-1);
+    }
+
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return (-1);
+    }
+    madvise(map, len, MADV_SEQUENTIAL | MADV_WILLNEED);
+    rv = -1;
+    if (!check_only) {
+        rv = devolve_passthrough(ctx, map, len, fd, dstf);
+    }
+    if (rv < 0) {
+        rv = process_mem(ctx, map, len, dstf);
+    }
+    munmap(map, len);
+    return (rv);
+}
+
+/*
+ * Devolve one file, named by |ctx->fname|.
+ *
+ * Regular files are memory-mapped.
+ * Pipes, stdin, and anything else that cannot be mapped
+ * are read as a stream.
+ *
+ * Return 2 if the file could not be opened;
+ * otherwise, return the status from the devolve engine.
+ */
+static int
+devolve_file(devolve_ctx_t *ctx, FILE *dstf)
 {
-    fvh_t fv;
     FILE *srcf;
+    int fd;
+    int rv;
+
+    if (strcmp(ctx->fname, "-") == 0) {
+        return (process_stream(ctx, stdin, dstf));
+    }
+
+    fd = open(ctx->fname, O_RDONLY);
+    if (fd < 0) {
+        return (2);
+    }
+    rv = devolve_mapped(ctx, fd, dstf);
+    if (rv >= 0) {
+        close(fd);
+        return (rv);
+    }
+
+    srcf = fdopen(fd, "r");
+    if (srcf == NULL) {
+        close(fd);
+        return (2);
+    }
+    rv = process_stream(ctx, srcf, dstf);
+    fclose(srcf);
+    return (rv);
+}
+
+/*
+ * Combine the status of one more file with the status so far.
+ * The worst status wins: 2 if any file could not be opened,
+ * otherwise 1 if any file had invalid bytes, otherwise 0.
+ */
+static inline int
+worst_status(int rv, int frv)
+{
+    return ((frv > rv) ? frv : rv);
+}
+
+/*
+ * Stop at the first file that can not be opened.
+ * With --check, the answer is already known at the first invalid file.
+ */
+static inline bool
+stop_after(int frv)
+{
+    return (frv == 2 || (check_only && frv != 0));
+}
+
+// ==================== Devolve several files at once
+
+/*
+ * With --threads=N, and more than one file, a pool of N worker threads
+ * devolves up to N files at once.  Each file's output, and its
+ * counts and trace messages, are collected in memory streams.
+ * The main thread writes them out in the original argument order,
+ * so the result is the same as devolving the files one after another.
+ *
+ * At most |nslots| files are in flight at any one time.
+ *
+ * Standard input is never handed to a worker.  When its turn comes,
+ * the main thread devolves it directly.
+ */
+
+struct file_slot {
+    bool done;
+    bool in_line;           // Not done by a worker; do it in-line
+    int rv;
+    char *obuf;
+    size_t olen;
+    char *ebuf;
+    size_t elen;
+};
+
+typedef struct file_slot file_slot_t;
+
+struct file_job {
+    size_t filec;
+    char **filev;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_done;
+    pthread_cond_t cond_room;
+    size_t next;            // Next file to be handed out
+    size_t written;         // Number of files already written
+    bool quit;              // Stop handing out files
+    size_t nslots;
+    file_slot_t *slots;
+};
+
+typedef struct file_job file_job_t;
+
+static void
+devolve_file_slot(file_job_t *job, size_t i, file_slot_t *slot)
+{
+    devolve_ctx_t ctx;
+    FILE *outf;
+    FILE *errf;
+
+    slot->in_line = true;
+    slot->obuf = NULL;
+    slot->olen = 0;
+    slot->ebuf = NULL;
+    slot->elen = 0;
+    if (strcmp(job->filev[i], "-") == 0) {
+        return;
+    }
+    outf = open_memstream(&slot->obuf, &slot->olen);
+    if (outf == NULL) {
+        return;
+    }
+    errf = open_memstream(&slot->ebuf, &slot->elen);
+    if (errf == NULL) {
+        fclose(outf);
+        free(slot->obuf);
+        slot->obuf = NULL;
+        return;
+    }
+
+    file_ctx_init(&ctx, job->filev[i], errf);
+    slot->rv = devolve_file(&ctx, outf);
+    fclose(outf);
+    fclose(errf);
+    slot->in_line = false;
+}
+
+static void *
+file_worker(void *arg)
+{
+    file_job_t *job;
+    file_slot_t *slot;
+    size_t i;
+
+    job = (file_job_t *)arg;
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+        while (!job->quit && job->next < job->filec && job->next >= job->written + job->nslots) {
+            pthread_cond_wait(&job->cond_room, &job->lock);
+        }
+        if (job->quit || job->next >= job->filec) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        slot = &job->slots[i % job->nslots];
+        devolve_file_slot(job, i, slot);
+
+        pthread_mutex_lock(&job->lock);
+        slot->done = true;
+        pthread_cond_broadcast(&job->cond_done);
+        pthread_mutex_unlock(&job->lock);
+    }
+    return (NULL);
+}
+
+static void
+free_file_slot(file_slot_t *slot)
+{
+    free(slot->obuf);
+    free(slot->ebuf);
+    slot->obuf = NULL;
+    slot->ebuf = NULL;
+}
+
+static int
+devolve_filev_pool(size_t filec, char **filev, FILE *dstf)
+{
+    file_job_t job;
+    pthread_t *tids;
+    unsigned int nstarted;
+    devolve_ctx_t ctx;
+    size_t i;
     int rv;
 
-    fv.filec = filec;
-    fv.filev = filev;
-    fv.glnr = 0;
+    memset(&job, 0, sizeof (job));
+    job.filec = filec;
+    job.filev = filev;
+    job.nslots = 2 * (size_t)nthreads;
+    job.slots = calloc(job.nslots, sizeof (file_slot_t));
+    tids = calloc(nthreads, sizeof (pthread_t));
+    if (job.slots == NULL || tids == NULL) {
+        free(job.slots);
+        free(tids);
+        return (-1);
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond_done, NULL);
+    pthread_cond_init(&job.cond_room, NULL);
+
+    for (nstarted = 0; nstarted < nthreads; ++nstarted) {
+        if (pthread_create(&tids[nstarted], NULL, file_worker, &job) != 0) {
+            break;
+        }
+    }
+
     rv = 0;
-    for (fv.fnr = 0; fv.fnr < filec; ++fv.fnr) {
-        fv.fname = fv.filev[fv.fnr];
-        if (strcmp(fv.fname, "-") == 0) {
-            srcf = stdin;
+    for (i = 0; i < filec; ++i) {
+        file_slot_t *slot;
+        int frv;
+
+        slot = &job.slots[i % job.nslots];
+        if (nstarted != 0) {
+            pthread_mutex_lock(&job.lock);
+            while (!slot->done) {
+                pthread_cond_wait(&job.cond_done, &job.lock);
+            }
+            pthread_mutex_unlock(&job.lock);
+        }
+        else {
+            slot->in_line = true;
+        }
+
+        if (slot->in_line) {
+            file_ctx_init(&ctx, filev[i], NULL);
+            frv = devolve_file(&ctx, dstf);
         }
         else {
-            srcf = fopen(fv.fname, "r");
+            frv = slot->rv;
+            fwrite(slot->obuf, 1, slot->olen, dstf);
+            fwrite(slot->ebuf, 1, slot->elen, stderr);
+            free_file_slot(slot);
+        }
+        rv = worst_status(rv, frv);
+
+        pthread_mutex_lock(&job.lock);
+        slot->done = false;
+        job.written = i + 1;
+        if (stop_after(frv)) {
+            job.quit = true;
         }
-        if (srcf == NULL) {
-            rv = 2;
+        pthread_cond_broadcast(&job.cond_room);
+        pthread_mutex_unlock(&job.lock);
+        if (stop_after(frv)) {
+            break;
+        }
+    }
+
+    while (nstarted != 0) {
+        --nstarted;
+        pthread_join(tids[nstarted], NULL);
+    }
+
+    // After stopping early, throw away the work
+    // that was already done on any files after that.
+    for (i = 0; i < job.nslots; ++i) {
+        free_file_slot(&job.slots[i]);
+    }
+
+    pthread_cond_destroy(&job.cond_room);
+    pthread_cond_destroy(&job.cond_done);
+    pthread_mutex_destroy(&job.lock);
+    free(tids);
+    free(job.slots);
+    return (rv);
+}
+
+/*
+ * Devolve each file in |filev|, in order.
+ */
+static int
+devolve_filev(size_t filec, char **filev, FILE *dstf)
+{
+    devolve_ctx_t ctx;
+    size_t i;
+    int frv;
+    int rv;
+
+    if (nthreads > 1 && filec > 1) {
+        // The threads go to whole files, not to chunks of each file.
+        chunk_threads = 1;
+        rv = devolve_filev_pool(filec, filev, dstf);
+        if (rv >= 0) {
+            return (rv);
+        }
+    }
+    chunk_threads = nthreads;
+
+    rv = 0;
+    for (i = 0; i < filec; ++i) {
+        file_ctx_init(&ctx, filev[i], NULL);
+        frv = devolve_file(&ctx, dstf);
+        rv = worst_status(rv, frv);
+        if (stop_after(frv)) {
             break;
         }
-        fv.fh = srcf;
-        rv = devolve_stream(&fv, dstf);
-        fclose(srcf);
     }
 
     return (rv);
@@ -385,6 +803,26 @@ main(int argc, char **argv)
         case 'u':
             devolve_options |= (unsigned int)OPT_TRACE_UNTRANS;
             break;
+        case 'k':
+            check_only = true;
+            check_arg = optarg;
+            break;
+        case 'T':
+            table_fname = optarg;
+            break;
+        case 'g':
+            engine_arg = optarg;
+            if (parse_engine(optarg) < 0) {
+                eprintf("Unknown engine, '%s'\n", optarg);
+                ++err_count;
+            }
+            break;
+        case 'j':
+            if (parse_thread_count(optarg, &nthreads) != 0) {
+                eprintf("Invalid number of threads, '%s'\n", optarg);
+                ++err_count;
+            }
+            break;
         case '?':
             eprint(program_name);
             eprint(": ");
@@ -407,6 +845,29 @@ main(int argc, char **argv)
         }
     }
 
+    if (check_only) {
+        check_what = (charset == CHARSET_LATIN1) ? CHECK_LATIN1 : CHECK_UTF8;
+        if (check_arg == NULL) {
+            // Check against --charset
+        }
+        else if (variant_strcmp(check_arg, "ascii", VARIANT_WORDS) == 0) {
+            check_what = CHECK_ASCII;
+        }
+        else if (variant_strcmp(check_arg, "latin-1", VARIANT_WORDS) == 0) {
+            check_what = CHECK_LATIN1;
+        }
+        else if (variant_strcmp(check_arg, "iso-8859-1", VARIANT_WORDS) == 0) {
+            check_what = CHECK_LATIN1;
+        }
+        else if (variant_strcmp(check_arg, "utf-8", VARIANT_ACRONYM) == 0) {
+            check_what = CHECK_UTF8;
+        }
+        else {
+            eprintf("Unknown character set for --check, '%s'\n", check_arg);
+            ++err_count;
+        }
+    }
+
     if (debug) {
         verbose = true;
     }
@@ -414,6 +875,14 @@ main(int argc, char **argv)
         devolve_options |= (unsigned int)OPT_SHOW_COUNTS;
     }
 
+    /*
+     * Unless counts are to be shown, only the exit status needs them,
+     * and that only needs the count of invalid characters.
+     */
+    if (!(devolve_options & (OPT_SHOW_COUNTS | OPT_SHOW_8BIT))) {
+        devolve_options |= (unsigned int)OPT_NO_COUNTS;
+    }
+
     if (optind < argc) {
         filec = (size_t) (argc - optind);
         filev = argv + optind;
@@ -440,6 +909,23 @@ main(int argc, char **argv)
         exit(2);
     }
 
+    if (engine_arg != NULL) {
+        if (devolve_set_engine((enum devolve_engine)parse_engine(engine_arg)) != 0) {
+            eprintf("%s: This CPU can not run the %s engine.\n", program_name, engine_arg);
+            exit(2);
+        }
+    }
+    if (verbose) {
+        eprintf("Engine: %s\n", devolve_engine_name(devolve_get_engine()));
+    }
+
+    if (table_fname != NULL) {
+        table = devolve_table_load(table_fname, errprint_fh);
+        if (table == NULL) {
+            exit(2);
+        }
+    }
+
     if (filec) {
         rv = filev_probe(filec, filev);
         if (rv != 0) {
@@ -0,0 +1,284 @@
+/*
+ * Filename: src/cmd/test/test-api.c
+ * Project: charset-devolve
+ * Brief: Test the memory-to-memory interfaces of libdevolve
+ *
+ * Copyright (C) 2016 Guy Shaw
+ * Written by Guy Shaw <gshaw@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * usage: test-api <table>
+ *
+ * <table> is a table compiled by build-table --binary
+ * from test-table.txt.
+ *
+ * devolve_into() is checked against known answers.  devolve_measure()
+ * and devolve_buf(), pushed a few bytes at a time into a small
+ * output buffer, are checked against devolve_into().
+ * devolve_passthrough() must keep the same counts as the engines.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+    // Import constant true
+#include <stdio.h>
+    // Import fclose()
+    // Import fflush()
+    // Import fileno()
+    // Import fopen()
+    // Import fprintf()
+    // Import fwrite()
+    // Import printf()
+    // Import tmpfile()
+    // Import type FILE
+#include <stdlib.h>
+    // Import rand()
+    // Import srand()
+#include <string.h>
+    // Import memcmp()
+    // Import memcpy()
+    // Import strcmp()
+    // Import strlen()
+
+#include <devolve.h>
+
+struct kat {
+    enum cset charset;
+    const char *in;
+    const char *out;
+    int rv;
+};
+
+typedef struct kat kat_t;
+
+/*
+ * Answers with the built-in table
+ */
+static const kat_t builtin_kats[] = {
+    { CHARSET_UTF8,   "plain ASCII\n",                    "plain ASCII\n",                 0 },
+    { CHARSET_UTF8,   "caf\xc3\xa9 \xe2\x80\x94 ok",      "cafe -- ok",                    0 },
+    { CHARSET_UTF8,   "\xc2\xa9 \xe2\x80\x9cq\xe2\x80\x9d", "(C) \"q\"",                  0 },
+    { CHARSET_UTF8,   "a\xc2\xad" "b\n\xf0\x9d\x90\x80\n", "ab\nA\n",                      0 },
+    { CHARSET_UTF8,   "bad \xff here",                    "bad *BAD:ff* here",             1 },
+    { CHARSET_UTF8,   "cut \xe2\x82",                     "cut *BAD:*",                    1 },
+    { CHARSET_LATIN1, "caf\xe9 \xa9",                     "cafe (C)",                      0 },
+    { CHARSET_LATIN1, "c1 \x85 control",                  "c1 \\x85 control",               1 },
+};
+
+/*
+ * Answers with the table compiled from test-table.txt,
+ * which has nothing for U+00E9.
+ */
+static const kat_t table_kats[] = {
+    { CHARSET_UTF8,   "\xc2\xa9 \xe2\x98\x83",            "(Copyright) (snowman)",         0 },
+    { CHARSET_UTF8,   "\xe2\x98\x83\n\xe2\x80\x94\n",     "(snowman)\n--\n",               0 },
+    { CHARSET_UTF8,   "bad \xff, \xc2\xa9",               "bad *BAD:ff*, (Copyright)",     1 },
+};
+
+static size_t ntests = 0;
+static size_t err = 0;
+
+static void
+failed(const char *what, const kat_t *kp, const char *got, size_t got_len)
+{
+    ++err;
+    printf("FAILED: %s\n", what);
+    printf("  in:       [%s]\n", kp->in);
+    printf("  expected: [%s]\n", kp->out);
+    printf("  got:      [%.*s]\n", (int)got_len, got);
+}
+
+static void
+test_into(const kat_t *kp, const devolve_table_t *tp)
+{
+    devolve_ctx_t ctx;
+    char out[256];
+    size_t len;
+    size_t mlen;
+    size_t cut;
+
+    devolve_ctx_init(&ctx, kp->charset, 0);
+    ctx.table = tp;
+    ++ntests;
+    len = devolve_into(&ctx, kp->in, strlen(kp->in), out, sizeof (out));
+    if (len != strlen(kp->out) || strcmp(out, kp->out) != 0) {
+        failed("devolve_into()", kp, out, len);
+    }
+    if (((ctx.counts.cnt_inval == 0) ? 0 : 1) != kp->rv) {
+        ++err;
+        printf("FAILED: devolve_into() counts %zu invalid, for [%s]\n",
+               ctx.counts.cnt_inval, kp->in);
+    }
+
+    ++ntests;
+    mlen = devolve_measure(&ctx, kp->in, strlen(kp->in));
+    if (mlen != len) {
+        ++err;
+        printf("FAILED: devolve_measure() says %zu, devolve_into() %zu, for [%s]\n",
+               mlen, len, kp->in);
+    }
+
+    // Too small: cut at the end of a translation, and terminated
+    ++ntests;
+    cut = len / 2 + 1;
+    len = devolve_into(&ctx, kp->in, strlen(kp->in), out, cut);
+    if (len != strlen(kp->out) || strlen(out) >= cut || memcmp(out, kp->out, strlen(out)) != 0) {
+        failed("devolve_into(), output cut short", kp, out, strlen(out));
+    }
+}
+
+/*
+ * Push |kp->in| through devolve_buf(), a random 1 to 3 bytes at a time,
+ * so that runes are split every way, into an output buffer
+ * that is only just big enough.
+ */
+static void
+test_buf(const kat_t *kp, const devolve_table_t *tp)
+{
+    devolve_ctx_t ctx;
+    char out[DEVOLVE_OUTPUT_MIN + 7];
+    char result[256];
+    size_t result_len;
+    size_t inlen;
+    size_t pos;
+    int rv;
+
+    devolve_ctx_init(&ctx, kp->charset, 0);
+    ctx.table = tp;
+    inlen = strlen(kp->in);
+    result_len = 0;
+    pos = 0;
+    ++ntests;
+    while (true) {
+        size_t n;
+        size_t used;
+        size_t outlen;
+        int last;
+
+        n = 1 + (size_t)rand() % 3;
+        if (n > inlen - pos) {
+            n = inlen - pos;
+        }
+        last = (pos + n == inlen);
+        rv = devolve_buf(&ctx, kp->in + pos, n, &used, out,
+                         DEVOLVE_OUTPUT_MIN + (size_t)rand() % 8, &outlen, last);
+        if (result_len + outlen > sizeof (result)) {
+            break;
+        }
+        memcpy(result + result_len, out, outlen);
+        result_len += outlen;
+        pos += used;
+        if (rv != DEVOLVE_OUTPUT_FULL && last) {
+            break;
+        }
+    }
+    if (result_len != strlen(kp->out) || memcmp(result, kp->out, result_len) != 0) {
+        failed("devolve_buf()", kp, result, result_len);
+    }
+    if (rv != kp->rv) {
+        ++err;
+        printf("FAILED: devolve_buf() returned %d, not %d, for [%s]\n", rv, kp->rv, kp->in);
+    }
+}
+
+/*
+ * Pass pure ASCII through, with counts asked for, but not shown,
+ * and then with no counts asked for.  The lines counted must be
+ * the same as devolve_into() counts.
+ */
+static void
+test_passthrough(void)
+{
+    static const char text[] = "one\ntwo\n\nfour, no newline";
+    devolve_ctx_t ctx;
+    FILE *srcf;
+    FILE *dstf;
+    unsigned int opt;
+    size_t want;
+    int rv;
+
+    srcf = tmpfile();
+    dstf = fopen("/dev/null", "w");
+    if (srcf == NULL || dstf == NULL || fwrite(text, 1, strlen(text), srcf) != strlen(text)) {
+        fprintf(stderr, "test-api: Could not set up passthrough test.\n");
+        exit(2);
+    }
+    fflush(srcf);
+
+    for (opt = 0; opt <= OPT_NO_COUNTS; opt += OPT_NO_COUNTS) {
+        ++ntests;
+        devolve_ctx_init(&ctx, CHARSET_UTF8, opt);
+        devolve_into(&ctx, text, strlen(text), NULL, 0);
+        want = ctx.counts.cnt_lines;
+        if (want == 0 && !(opt & OPT_NO_COUNTS)) {
+            ++err;
+            printf("FAILED: devolve_into() counted no lines\n");
+        }
+        rv = devolve_passthrough(&ctx, text, strlen(text), fileno(srcf), dstf);
+        if (rv != 0 || ctx.counts.cnt_lines != want) {
+            ++err;
+            printf("FAILED: devolve_passthrough(), opt=%#x, returned %d, counted %zu lines, not %zu\n",
+                   opt, rv, ctx.counts.cnt_lines, want);
+        }
+    }
+
+    fclose(dstf);
+    fclose(srcf);
+}
+
+static void
+test_kats(const kat_t *kats, size_t nkats, const devolve_table_t *tp)
+{
+    size_t i;
+    int round;
+
+    for (i = 0; i < nkats; ++i) {
+        test_into(&kats[i], tp);
+        for (round = 0; round < 20; ++round) {
+            test_buf(&kats[i], tp);
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    devolve_table_t *tp;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: test-api <table>\n");
+        exit(2);
+    }
+    srand(1);
+    test_kats(builtin_kats, sizeof (builtin_kats) / sizeof (builtin_kats[0]), NULL);
+
+    tp = devolve_table_load(argv[1], NULL);
+    if (tp == NULL) {
+        exit(2);
+    }
+    test_kats(table_kats, sizeof (table_kats) / sizeof (table_kats[0]), tp);
+    devolve_table_free(tp);
+
+    test_passthrough();
+
+    if (err != 0) {
+        printf("Tests run: %zu\n", ntests);
+        printf("Errors:    %zu\n", err);
+    }
+    exit(err != 0);
+}
@@ -0,0 +1,187 @@
+/*
+ * Filename: src/cmd/test/test-hpp.cpp
+ * Project: charset-devolve
+ * Brief: Test the C++ interface, devolve.hpp
+ *
+ * Copyright (C) 2016 Guy Shaw
+ * Written by Guy Shaw <gshaw@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * usage: test-hpp <table>
+ *
+ * <table> is a table compiled by build-table --binary
+ * from test-table.txt.
+ *
+ * Every kind of sink is checked against devolve_into(), with input
+ * that is larger than one bufferful, and with input that grows
+ * several times over when devolved.
+ */
+
+#include <cstdio>
+    // Import std::fprintf()
+    // Import std::printf()
+#include <cstdlib>
+    // Import std::exit()
+#include <iterator>
+    // Import std::back_inserter()
+#include <string>
+    // Import type std::string
+#include <string_view>
+    // Import type std::string_view
+#include <vector>
+    // Import type std::vector
+
+#include <devolve.hpp>
+
+static std::size_t ntests = 0;
+static std::size_t err = 0;
+
+static void
+check(bool ok, const char *what, const std::string &name)
+{
+    ++ntests;
+    if (!ok) {
+        ++err;
+        std::printf("FAILED: %s, %s\n", what, name.c_str());
+    }
+}
+
+/*
+ * Collects output through a member write().
+ * It refers to a string, so that it can be passed as a temporary.
+ */
+struct writer {
+    std::string &acc;
+
+    void write(const char *p, std::size_t n) { acc.append(p, n); }
+};
+
+static std::string
+expected(devolve::context &ctx, std::string_view in)
+{
+    std::string out;
+    std::size_t len;
+
+    len = devolve_into(ctx.get(), in.data(), in.size(), nullptr, 0);
+    out.resize(len + 1);
+    devolve_into(ctx.get(), in.data(), in.size(), &out[0], out.size());
+    out.resize(len);
+    return (out);
+}
+
+static void
+test_sinks(devolve::context &ctx, const std::string &name, std::string_view in, int rv)
+{
+    std::string ans;
+
+    ans = expected(ctx, in);
+
+    // std::string, appended to
+    std::string s("prefix:");
+    check(devolve::devolve(ctx, in, s) == rv, "string, status", name);
+    check(s == "prefix:" + ans, "string", name);
+
+    // A writer, and a temporary writer
+    std::string acc;
+    writer w{acc};
+    check(devolve::devolve(ctx, in, w) == rv, "writer, status", name);
+    check(acc == ans, "writer", name);
+    acc.clear();
+    check(devolve::devolve(ctx, in, writer{acc}) == rv, "temporary writer, status", name);
+    check(acc == ans, "temporary writer", name);
+
+    // Iterators are handed back, advanced past the output
+    std::vector<char> v(ans.size() + 1, 'X');
+    char *end = devolve::devolve(ctx, in, v.data());
+    check(end == v.data() + ans.size(), "pointer, where it ends", name);
+    check(std::string(v.data(), ans.size()) == ans && v.back() == 'X', "pointer", name);
+    check(ctx.status() == rv, "pointer, status", name);
+
+    std::vector<char> bv;
+    devolve::devolve(ctx, in, std::back_inserter(bv));
+    check(std::string(bv.begin(), bv.end()) == ans, "back_inserter", name);
+
+    // The counts are for this input alone
+    std::string again;
+    devolve::devolve(ctx, in, again);
+    devolve::devolve(ctx, in, again);
+    check(again == ans + ans, "string, twice", name);
+    check(ctx.status() == rv, "counts, reset", name);
+}
+
+static void
+test_view(devolve::context &ctx)
+{
+    std::string storage;
+    std::string_view plain("plain ASCII, as it is\n");
+    std::string_view in("caf\xc3\xa9\n");
+    std::string_view view;
+
+    view = devolve::devolve_view(ctx, plain, storage);
+    check(view.data() == plain.data() && view == plain, "view, unchanged", "plain");
+    view = devolve::devolve_view(ctx, in, storage);
+    check(view.data() == storage.data() && view == "cafe\n", "view, devolved", "cafe");
+}
+
+static std::string
+repeat(std::string_view s, std::size_t n)
+{
+    std::string r;
+
+    while (n-- != 0) {
+        r += s;
+    }
+    return (r);
+}
+
+int
+main(int argc, char **argv)
+{
+    devolve_table_t *tp;
+
+    if (argc != 2) {
+        std::fprintf(stderr, "usage: test-hpp <table>\n");
+        std::exit(2);
+    }
+
+    devolve::context ctx;
+    test_sinks(ctx, "short", "caf\xc3\xa9 \xe2\x80\x94 \xf0\x9d\x90\x80\n", 0);
+    test_sinks(ctx, "invalid", "bad \xff and cut \xe2\x82", 1);
+    test_sinks(ctx, "empty", "", 0);
+    test_sinks(ctx, "long", repeat("Line: caf\xc3\xa9 \xe2\x80\x94 ok\n", 5000), 0);
+    test_view(ctx);
+
+    devolve::context latin1(CHARSET_LATIN1);
+    test_sinks(latin1, "latin1", repeat("caf\xe9 \xa9\n", 5000), 0);
+
+    // Each 2-byte rune becomes 11 bytes, so a string must grow
+    tp = devolve_table_load(argv[1], nullptr);
+    if (tp == nullptr) {
+        std::exit(2);
+    }
+    ctx.set_table(tp);
+    test_sinks(ctx, "table, growing", repeat("\xc2\xa9", 20000), 0);
+    test_sinks(ctx, "table, invalid", repeat("\xc2\xa9\xff", 3000), 1);
+    ctx.set_table(nullptr);
+    devolve_table_free(tp);
+
+    if (err != 0) {
+        std::printf("Tests run: %zu\n", ntests);
+        std::printf("Errors:    %zu\n", err);
+    }
+    std::exit(err != 0);
+}